@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <string_view>
+#include <boost/asio.hpp>
+
+#include "PacketPacer.h"
+#include "GlobalContext.h"
+
+using boost::asio::ip::udp;
+
+namespace {
+    // 目标数超过这个值时才清理空闲的令牌桶
+    constexpr std::size_t MinPruneThreshold = 4096;
+
+    std::chrono::microseconds SlotInterval(double rate)
+    {
+        return std::chrono::microseconds(static_cast<int64_t>(1e6 / std::max(rate, 1e-3)));
+    }
+
+    std::chrono::microseconds SlotTolerance(double rate, double burst)
+    {
+        return std::chrono::microseconds(static_cast<int64_t>(1e6 / std::max(rate, 1e-3) * std::max(burst - 1.0, 0.0)));
+    }
+}
+
+PacketPacer::PacketPacer(std::shared_ptr<boost::asio::io_context> ioc) : PacketPacer(std::move(ioc), Options())
+{
+
+}
+
+PacketPacer::PacketPacer(std::shared_ptr<boost::asio::io_context> ioc, Options opt) : ioc(std::move(ioc)), options(opt)
+{
+
+}
+
+PacketPacer::~PacketPacer()
+{
+
+}
+
+void PacketPacer::SetOptions(Options opt)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    options = opt;
+}
+
+auto PacketPacer::GetOptions() const -> Options
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return options;
+}
+
+auto PacketPacer::Bucket::Earliest(clock::time_point now, std::chrono::microseconds tolerance) const -> clock::time_point
+{
+    // 令牌足够时立即发送，否则排到下一个空闲时隙
+    return std::max(now, tat - tolerance);
+}
+
+void PacketPacer::Bucket::Commit(clock::time_point slot, std::chrono::microseconds interval)
+{
+    tat = std::max(tat, slot) + interval;
+}
+
+std::size_t PacketPacer::EndpointHash::operator()(const udp::endpoint &ep) const
+{
+    // 在锁内调用，不能分配内存
+    const boost::asio::ip::address &addr = ep.address();
+    std::size_t seed;
+    if (addr.is_v4())
+        seed = std::hash<uint32_t>()(addr.to_v4().to_uint());
+    else
+    {
+        const boost::asio::ip::address_v6::bytes_type bytes = addr.to_v6().to_bytes();
+        seed = std::hash<std::string_view>()(std::string_view(reinterpret_cast<const char *>(bytes.data()), bytes.size()));
+    }
+    return seed ^ (std::hash<uint16_t>()(ep.port()) + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+void PacketPacer::PruneIdleTargets(clock::time_point now)
+{
+    for (auto iter = target_buckets.begin(); iter != target_buckets.end();)
+    {
+        if (iter->second.Idle(now))
+            iter = target_buckets.erase(iter);
+        else
+            ++iter;
+    }
+    // 剩下的都还在活跃时，等数量翻倍再清理，避免每次预约都全表扫描
+    prune_threshold = std::max(MinPruneThreshold, target_buckets.size() * 2);
+}
+
+auto PacketPacer::Reserve(const udp::endpoint &target) -> clock::time_point
+{
+    const clock::time_point now = clock::now();
+    std::lock_guard<std::mutex> lock(mtx);
+
+    if (target_buckets.size() > prune_threshold)
+        PruneIdleTargets(now);
+
+    // 全局桶和目标桶都要有令牌，取两者中较晚的时隙
+    // 两个桶都按实际发送的时隙记账，否则全局排队时同一目标的包会在之后连续发出
+    Bucket &target_bucket = target_buckets[target];
+    const clock::time_point slot = std::max(
+            target_bucket.Earliest(now, SlotTolerance(options.PerTargetRate, options.PerTargetBurst)),
+            global_bucket.Earliest(now, SlotTolerance(options.GlobalRate, options.GlobalBurst)));
+    target_bucket.Commit(slot, SlotInterval(options.PerTargetRate));
+    global_bucket.Commit(slot, SlotInterval(options.GlobalRate));
+    return slot;
+}
+
+void PacketPacer::AsyncWait(const udp::endpoint &target, std::function<void(boost::system::error_code)> handler)
+{
+    AsyncWait(target, ioc->get_executor(), std::move(handler));
+}
+
+std::shared_ptr<PacketPacer> GlobalPacketPacerSingleton()
+{
+    static auto sp = std::make_shared<PacketPacer>(GlobalContextSingleton());
+    return sp;
+}
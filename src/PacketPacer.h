@@ -0,0 +1,78 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/post.hpp>
+
+// 发包节流：全局令牌桶 + 每个目标地址单独的令牌桶
+// 避免一次性扇出大量查询时产生突发流量，导致接收缓冲区溢出或触发服务器的 A2S 防洪保护
+class PacketPacer
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct Options
+    {
+        double GlobalRate = 2000.0; // 全局每秒发包数
+        double GlobalBurst = 64.0; // 全局允许的突发包数
+        double PerTargetRate = 20.0; // 单个目标每秒发包数
+        double PerTargetBurst = 4.0; // 单个目标允许的突发包数
+    };
+
+    explicit PacketPacer(std::shared_ptr<boost::asio::io_context> ioc);
+    PacketPacer(std::shared_ptr<boost::asio::io_context> ioc, Options opt);
+    ~PacketPacer();
+
+    void SetOptions(Options opt);
+    Options GetOptions() const;
+
+    // 预约一个发包时隙，到达时在 io_context 上调用 handler
+    void AsyncWait(const boost::asio::ip::udp::endpoint &target, std::function<void(boost::system::error_code)> handler);
+
+    // 同上，但 handler 在指定的 executor（比如查询自己的 strand）上调用
+    template<class Executor>
+    void AsyncWait(const boost::asio::ip::udp::endpoint &target, const Executor &ex, std::function<void(boost::system::error_code)> handler)
+    {
+        const clock::time_point slot = Reserve(target);
+        if (slot <= clock::now())
+            return boost::asio::post(ex, std::bind(std::move(handler), boost::system::error_code())), void();
+
+        std::shared_ptr<boost::asio::steady_timer> timer = std::make_shared<boost::asio::steady_timer>(ex);
+        timer->expires_at(slot);
+        timer->async_wait([timer, handler = std::move(handler)](boost::system::error_code ec) {
+            handler(ec);
+        });
+    }
+
+private:
+    // GCRA 形式的令牌桶，以微秒为时隙
+    struct Bucket
+    {
+        clock::time_point tat{}; // theoretical arrival time
+        clock::time_point Earliest(clock::time_point now, std::chrono::microseconds tolerance) const;
+        void Commit(clock::time_point slot, std::chrono::microseconds interval);
+        bool Idle(clock::time_point now) const { return tat <= now; }
+    };
+
+    struct EndpointHash
+    {
+        std::size_t operator()(const boost::asio::ip::udp::endpoint &ep) const;
+    };
+
+    clock::time_point Reserve(const boost::asio::ip::udp::endpoint &target);
+    void PruneIdleTargets(clock::time_point now);
+
+    const std::shared_ptr<boost::asio::io_context> ioc;
+    mutable std::mutex mtx;
+    Options options;
+    Bucket global_bucket;
+    std::unordered_map<boost::asio::ip::udp::endpoint, Bucket, EndpointHash> target_buckets;
+    std::size_t prune_threshold = 4096;
+};
+
+std::shared_ptr<PacketPacer> GlobalPacketPacerSingleton();
@@ -0,0 +1,397 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <atomic>
+#include <memory>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <stdexcept>
+#include <type_traits>
+
+#include "TSourceEngineQuery.h"
+
+// 按需解码 A2S_INFO 回复，调用方在模板参数中列出需要的字段
+// 没有列出的字段只跳过不解码，最后一个需要的字段之后的数据不会再读
+// 字符串以 string_view 指向原缓冲区，不分配内存，只在缓冲区有效期间可用
+//
+//   using Filter = ServerInfoDecoder::Decoder<Field_e::Map, Field_e::PlayerCount, Field_e::MaxPlayers>;
+//   auto result = Filter::Decode(reply, reply_length);
+//   if (result.Get<Field_e::Map>() == "de_dust2") ...
+namespace ServerInfoDecoder
+{
+    enum class Field_e : uint8_t
+    {
+        Protocol,
+        ServerName,
+        Map,
+        Folder,
+        Game,
+        SteamID,
+        PlayerCount,
+        MaxPlayers,
+        BotCount,
+        ServerType,
+        Environment,
+        Visibility,
+        VAC,
+        GameVersion,
+        EDF,
+        Port, // EDF 0x80
+        SteamIDExtended, // EDF 0x10
+        SourceTVPort, // EDF 0x40
+        SourceTVName, // EDF 0x40
+        Keywords, // EDF 0x20
+        GameID, // EDF 0x01
+        LocalAddress, // 以下只有非Steam版有
+        Mod,
+        ModLink,
+        ModDownloadLink,
+        ModReserved,
+        ModVersion,
+        ModSize,
+        ModType,
+        ModDLL,
+    };
+
+    enum class Wire_e : uint8_t
+    {
+        Byte,
+        Short,
+        Long,
+        LongLong,
+        String,
+    };
+
+    struct Slot_s
+    {
+        Field_e Field;
+        Wire_e Wire;
+        uint8_t EDFMask; // 非零时只有 EDF 中对应位被设置才出现
+        bool ModOnly; // 只有 Mod 为真时才出现
+    };
+
+    // Steam版 ('I') 的字段顺序
+    inline constexpr Slot_s SourceSlots[] = {
+        { Field_e::Protocol, Wire_e::Byte, 0, false },
+        { Field_e::ServerName, Wire_e::String, 0, false },
+        { Field_e::Map, Wire_e::String, 0, false },
+        { Field_e::Folder, Wire_e::String, 0, false },
+        { Field_e::Game, Wire_e::String, 0, false },
+        { Field_e::SteamID, Wire_e::Short, 0, false },
+        { Field_e::PlayerCount, Wire_e::Byte, 0, false },
+        { Field_e::MaxPlayers, Wire_e::Byte, 0, false },
+        { Field_e::BotCount, Wire_e::Byte, 0, false },
+        { Field_e::ServerType, Wire_e::Byte, 0, false },
+        { Field_e::Environment, Wire_e::Byte, 0, false },
+        { Field_e::Visibility, Wire_e::Byte, 0, false },
+        { Field_e::VAC, Wire_e::Byte, 0, false },
+        { Field_e::GameVersion, Wire_e::String, 0, false },
+        { Field_e::EDF, Wire_e::Byte, 0, false },
+        { Field_e::Port, Wire_e::Short, 0x80, false },
+        { Field_e::SteamIDExtended, Wire_e::LongLong, 0x10, false },
+        { Field_e::SourceTVPort, Wire_e::Short, 0x40, false },
+        { Field_e::SourceTVName, Wire_e::String, 0x40, false },
+        { Field_e::Keywords, Wire_e::String, 0x20, false },
+        { Field_e::GameID, Wire_e::LongLong, 0x01, false },
+    };
+
+    // 非Steam版 ('m') 的字段顺序
+    inline constexpr Slot_s GoldSrcSlots[] = {
+        { Field_e::LocalAddress, Wire_e::String, 0, false },
+        { Field_e::ServerName, Wire_e::String, 0, false },
+        { Field_e::Map, Wire_e::String, 0, false },
+        { Field_e::Folder, Wire_e::String, 0, false },
+        { Field_e::Game, Wire_e::String, 0, false },
+        { Field_e::PlayerCount, Wire_e::Byte, 0, false },
+        { Field_e::MaxPlayers, Wire_e::Byte, 0, false },
+        { Field_e::Protocol, Wire_e::Byte, 0, false },
+        { Field_e::ServerType, Wire_e::Byte, 0, false },
+        { Field_e::Environment, Wire_e::Byte, 0, false },
+        { Field_e::Visibility, Wire_e::Byte, 0, false },
+        { Field_e::Mod, Wire_e::Byte, 0, false },
+        { Field_e::ModLink, Wire_e::String, 0, true },
+        { Field_e::ModDownloadLink, Wire_e::String, 0, true },
+        { Field_e::ModReserved, Wire_e::Byte, 0, true },
+        { Field_e::ModVersion, Wire_e::Long, 0, true },
+        { Field_e::ModSize, Wire_e::Long, 0, true },
+        { Field_e::ModType, Wire_e::Byte, 0, true },
+        { Field_e::ModDLL, Wire_e::Byte, 0, true },
+        { Field_e::VAC, Wire_e::Byte, 0, false },
+        { Field_e::BotCount, Wire_e::Byte, 0, false },
+    };
+
+    constexpr Wire_e WireOf(Field_e field)
+    {
+        for (const Slot_s &slot : SourceSlots)
+            if (slot.Field == field)
+                return slot.Wire;
+        for (const Slot_s &slot : GoldSrcSlots)
+            if (slot.Field == field)
+                return slot.Wire;
+        return Wire_e::Byte;
+    }
+
+    constexpr uint64_t Bit(Field_e field)
+    {
+        return uint64_t(1) << static_cast<unsigned>(field);
+    }
+
+    template<Wire_e W> struct WireType;
+    template<> struct WireType<Wire_e::Byte> { using type = uint8_t; };
+    template<> struct WireType<Wire_e::Short> { using type = int16_t; };
+    template<> struct WireType<Wire_e::Long> { using type = int32_t; };
+    template<> struct WireType<Wire_e::LongLong> { using type = uint64_t; };
+    template<> struct WireType<Wire_e::String> { using type = std::string_view; };
+
+    template<Field_e F> struct FieldType { using type = typename WireType<WireOf(F)>::type; };
+    template<> struct FieldType<Field_e::ServerType> { using type = TSourceEngineQuery::ServerType_e; };
+    template<> struct FieldType<Field_e::Environment> { using type = TSourceEngineQuery::Environment_e; };
+    template<> struct FieldType<Field_e::Visibility> { using type = TSourceEngineQuery::Visibility_e; };
+    template<> struct FieldType<Field_e::VAC> { using type = bool; };
+    template<> struct FieldType<Field_e::Mod> { using type = bool; };
+
+    template<Field_e F>
+    using FieldType_t = typename FieldType<F>::type;
+
+    class Cursor
+    {
+    public:
+        Cursor(const char *data, std::size_t length) : ptr(data), end(data + length) {}
+
+        bool Eof() const { return ptr >= end; }
+
+        template<class T>
+        T Read()
+        {
+            if constexpr (std::is_same_v<T, std::string_view>)
+            {
+                // 缺少结尾的 0 时取到缓冲区末尾
+                const char *zero = static_cast<const char *>(std::memchr(ptr, 0, end - ptr));
+                const char *str_end = zero ? zero : end;
+                std::string_view result(ptr, str_end - ptr);
+                ptr = zero ? zero + 1 : end;
+                return result;
+            }
+            else
+            {
+                if (static_cast<std::size_t>(end - ptr) < sizeof(T))
+                    throw std::runtime_error("服务器信息数据不完整");
+                T value;
+                std::memcpy(&value, ptr, sizeof(T));
+                ptr += sizeof(T);
+                return value;
+            }
+        }
+
+        void Skip(Wire_e wire)
+        {
+            switch (wire)
+            {
+            case Wire_e::Byte: Read<uint8_t>(); break;
+            case Wire_e::Short: Read<int16_t>(); break;
+            case Wire_e::Long: Read<int32_t>(); break;
+            case Wire_e::LongLong: Read<uint64_t>(); break;
+            case Wire_e::String: Read<std::string_view>(); break;
+            }
+        }
+
+    private:
+        const char *ptr;
+        const char *const end;
+    };
+
+    template<Field_e... Fields>
+    class Decoder
+    {
+    public:
+        static constexpr uint64_t Requested = (uint64_t(0) | ... | Bit(Fields));
+
+        struct Result
+        {
+            uint8_t Header = 0; // 'I'、'm' 或 'i'（Xash3D，没有 SteamID、BotCount、VAC 等字段）
+            uint64_t Present = 0;
+            std::tuple<FieldType_t<Fields>...> Values{};
+
+            template<Field_e F>
+            bool Has() const
+            {
+                return Present & Bit(F);
+            }
+
+            template<Field_e F>
+            const FieldType_t<F> &Get() const
+            {
+                static_assert(IndexOf(F) < sizeof...(Fields), "只能取 Decoder 模板参数中列出的字段");
+                return std::get<IndexOf(F)>(Values);
+            }
+        };
+
+        static Result Decode(const char *reply, std::size_t reply_length)
+        {
+            Cursor cur(reply, reply_length);
+            Result result;
+            if (cur.Read<int32_t>() != -1)
+                throw std::runtime_error("错误的返回数据头部(-1)");
+
+            result.Header = cur.Read<uint8_t>();
+            if (result.Header == 'I')
+                DecodeSlots<SourceSlots>(cur, result, std::make_index_sequence<LastRequested(SourceSlots)>());
+            else if (result.Header == 'm')
+                DecodeSlots<GoldSrcSlots>(cur, result, std::make_index_sequence<LastRequested(GoldSrcSlots)>());
+            else if (result.Header == 'i')
+                DecodeInfoString(cur.Read<std::string_view>(), result);
+            else
+                throw std::runtime_error("不支持的服务器信息协议格式");
+            return result;
+        }
+
+    private:
+        static constexpr std::size_t IndexOf(Field_e field)
+        {
+            constexpr Field_e fields[] = { Fields... };
+            for (std::size_t i = 0; i < sizeof...(Fields); ++i)
+                if (fields[i] == field)
+                    return i;
+            return sizeof...(Fields);
+        }
+
+        // 最后一个需要解码的字段之后的数据不用读
+        template<std::size_t N>
+        static constexpr std::size_t LastRequested(const Slot_s (&slots)[N])
+        {
+            std::size_t last = 0;
+            for (std::size_t i = 0; i < N; ++i)
+                if (Requested & Bit(slots[i].Field))
+                    last = i + 1;
+            return last;
+        }
+
+        struct State_s
+        {
+            uint8_t EDF = 0;
+            bool Mod = false;
+        };
+
+        template<const Slot_s *Slots, std::size_t... I>
+        static void DecodeSlots(Cursor &cur, Result &result, std::index_sequence<I...>)
+        {
+            State_s state;
+            (DecodeSlot<Slots, I>(cur, result, state), ...);
+        }
+
+        template<const Slot_s *Slots, std::size_t I>
+        static void DecodeSlot(Cursor &cur, Result &result, State_s &state)
+        {
+            constexpr Slot_s Slot = Slots[I];
+            if constexpr (Slot.EDFMask != 0)
+            {
+                if (!(state.EDF & Slot.EDFMask))
+                    return;
+            }
+            if constexpr (Slot.ModOnly)
+            {
+                if (!state.Mod)
+                    return;
+            }
+
+            using T = typename WireType<Slot.Wire>::type;
+            if constexpr (Slot.Field == Field_e::EDF)
+            {
+                // EDF 是可选的
+                if (cur.Eof())
+                    return;
+                state.EDF = cur.Read<T>();
+                Store<Slot.Field>(result, state.EDF);
+            }
+            else if constexpr (Slot.Field == Field_e::Mod)
+            {
+                state.Mod = cur.Read<T>();
+                Store<Slot.Field>(result, state.Mod);
+            }
+            else if constexpr ((Requested & Bit(Slot.Field)) != 0)
+            {
+                Store<Slot.Field>(result, cur.Read<T>());
+            }
+            else
+            {
+                cur.Skip(Slot.Wire);
+            }
+        }
+
+        // Xash3D版，"info\n" 后面是 \key\value 形式的 infostring，键的顺序不固定
+        static void DecodeInfoString(std::string_view str, Result &result)
+        {
+            if (str.substr(0, 4) != "nfo\n")
+                throw std::runtime_error("不支持的服务器信息协议格式");
+            str.remove_prefix(4);
+
+            bool has_map = false;
+            while (!str.empty() && str[0] == '\\')
+            {
+                const std::size_t key_end = str.find('\\', 1);
+                if (key_end == std::string_view::npos)
+                    break;
+                const std::size_t value_end = str.find_first_of("\\\n", key_end + 1);
+                const std::string_view key = str.substr(1, key_end - 1);
+                const std::string_view value = str.substr(key_end + 1, value_end == std::string_view::npos ? std::string_view::npos : value_end - key_end - 1);
+                str.remove_prefix(value_end == std::string_view::npos ? str.size() : value_end);
+
+                if (key == "p")
+                    StoreNumber<Field_e::Protocol>(result, value);
+                else if (key == "host")
+                    Store<Field_e::ServerName>(result, value);
+                else if (key == "map")
+                    Store<Field_e::Map>(result, value), has_map = true;
+                else if (key == "gamedir")
+                    Store<Field_e::Folder>(result, value), Store<Field_e::Game>(result, value);
+                else if (key == "numcl")
+                    StoreNumber<Field_e::PlayerCount>(result, value);
+                else if (key == "maxcl")
+                    StoreNumber<Field_e::MaxPlayers>(result, value);
+                else if (key == "password")
+                    Store<Field_e::Visibility>(result, value.empty() || value == "0" ? TSourceEngineQuery::Public : TSourceEngineQuery::Private);
+            }
+            if (!has_map)
+                throw std::runtime_error("Xash3D服务器返回的信息不完整");
+        }
+
+        template<Field_e F>
+        static void StoreNumber(Result &result, std::string_view value)
+        {
+            if constexpr ((Requested & Bit(F)) != 0)
+            {
+                int number = 0;
+                std::from_chars(value.data(), value.data() + value.size(), number);
+                Store<F>(result, number);
+            }
+        }
+
+        template<Field_e F, class T>
+        static void Store(Result &result, T value)
+        {
+            if constexpr ((Requested & Bit(F)) != 0)
+            {
+                std::get<IndexOf(F)>(result.Values) = static_cast<FieldType_t<F>>(value);
+                result.Present |= Bit(F);
+            }
+        }
+    };
+
+    // 查询服务器信息并按需解码，回调中的 string_view 只在回调期间有效
+    template<class DecoderType>
+    void QueryAsync(TSourceEngineQuery &tseq, const char *host, const char *port, std::chrono::seconds timeout, TSourceEngineQuery::QueryHandler<const typename DecoderType::Result &> handler)
+    {
+        std::shared_ptr<std::atomic<bool>> done = std::make_shared<std::atomic<bool>>(false);
+        tseq.GetServerInfoReplyAsync(host, port, timeout, [handler, done](const char *reply, std::size_t reply_length, const std::string &, uint16_t) {
+            typename DecoderType::Result result = DecoderType::Decode(reply, reply_length);
+            if (!done->exchange(true))
+                handler(nullptr, result);
+        }, [handler, done](std::exception_ptr exc) {
+            if (!done->exchange(true))
+                handler(exc, typename DecoderType::Result());
+        });
+    }
+}
@@ -0,0 +1,497 @@
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <condition_variable>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+#include "ServerListIO.h"
+
+namespace {
+    constexpr std::size_t ReadBufferSize = 64 * 1024;
+    constexpr const char *DefaultPort = "27015";
+
+    bool IsSpace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    void Trim(std::string &str)
+    {
+        std::size_t first = 0;
+        while (first < str.size() && IsSpace(str[first]))
+            ++first;
+        std::size_t last = str.size();
+        while (last > first && IsSpace(str[last - 1]))
+            --last;
+        str.erase(last);
+        str.erase(0, first);
+    }
+
+    // host:port 或者只有 host
+    void SplitHostPort(const char *begin, const char *end, ServerListIO::Endpoint_s &out)
+    {
+        const char *colon = std::find(begin, end, ':');
+        out.Host.assign(begin, colon);
+        if (colon != end && colon + 1 != end)
+            out.Port.assign(colon + 1, end);
+        else
+            out.Port.assign(DefaultPort);
+    }
+
+    // 读一个 JSON 字符串，pos 指向开头的引号，返回后指向结尾引号之后
+    bool ReadJsonString(const std::string &str, std::size_t &pos, std::string &out)
+    {
+        out.clear();
+        for (++pos; pos < str.size(); ++pos)
+        {
+            char c = str[pos];
+            if (c == '"')
+                return ++pos, true;
+            if (c != '\\')
+            {
+                out.push_back(c);
+                continue;
+            }
+            if (++pos >= str.size())
+                return false;
+            switch (str[pos])
+            {
+            case 'n': out.push_back('\n'); break;
+            case 't': out.push_back('\t'); break;
+            case 'r': out.push_back('\r'); break;
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'u':
+            {
+                if (pos + 4 >= str.size())
+                    return false;
+                unsigned code = 0;
+                if (std::from_chars(str.data() + pos + 1, str.data() + pos + 5, code, 16).ec != std::errc())
+                    return false;
+                pos += 4;
+                if (code < 0x80)
+                    out.push_back(static_cast<char>(code));
+                else if (code < 0x800)
+                    out.push_back(static_cast<char>(0xC0 | (code >> 6))), out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+                else
+                    out.push_back(static_cast<char>(0xE0 | (code >> 12))), out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F))), out.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+                break;
+            }
+            default: out.push_back(str[pos]); break;
+            }
+        }
+        return false;
+    }
+
+    void AppendJsonString(std::string &buffer, const std::string &value)
+    {
+        static constexpr char hex[] = "0123456789abcdef";
+        buffer.push_back('"');
+        for (char c : value)
+        {
+            switch (c)
+            {
+            case '"': buffer.append("\\\""); break;
+            case '\\': buffer.append("\\\\"); break;
+            case '\n': buffer.append("\\n"); break;
+            case '\r': buffer.append("\\r"); break;
+            case '\t': buffer.append("\\t"); break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    buffer.append("\\u00");
+                    buffer.push_back(hex[(c >> 4) & 0xF]);
+                    buffer.push_back(hex[c & 0xF]);
+                }
+                else
+                    buffer.push_back(c);
+            }
+        }
+        buffer.push_back('"');
+    }
+
+    void AppendCsvString(std::string &buffer, const std::string &value)
+    {
+        if (value.find_first_of(",\"\r\n") == std::string::npos)
+            return buffer.append(value), void();
+        buffer.push_back('"');
+        for (char c : value)
+        {
+            if (c == '"')
+                buffer.push_back('"');
+            buffer.push_back(c);
+        }
+        buffer.push_back('"');
+    }
+
+    void AppendTextString(std::string &buffer, const std::string &value)
+    {
+        for (char c : value)
+            buffer.push_back(c == '\t' || c == '\r' || c == '\n' ? ' ' : c);
+    }
+
+    const char *const FieldNames[] = {
+        "address", "port", "name", "map", "game", "folder", "players", "max_players", "bots", "protocol", "environment", "vac", "error"
+    };
+}
+
+auto ServerListIO::FormatFromFileName(const std::string &filename) -> Format_e
+{
+    auto ends_with = [&filename](const char *ext) {
+        const std::size_t len = std::strlen(ext);
+        return filename.size() >= len && std::equal(filename.end() - len, filename.end(), ext, ext + len, [](char a, char b) {
+            return std::tolower(static_cast<unsigned char>(a)) == b;
+        });
+    };
+    if (ends_with(".csv"))
+        return Format_e::CSV;
+    if (ends_with(".ndjson") || ends_with(".jsonl"))
+        return Format_e::NDJSON;
+    return Format_e::Text;
+}
+
+ServerListIO::Reader::Reader(std::FILE *fp, Format_e format) : fp(fp), format(format), buffer(ReadBufferSize, '\0')
+{
+
+}
+
+bool ServerListIO::Reader::ReadLine()
+{
+    line.clear();
+    while (true)
+    {
+        if (buffer_pos == buffer_end)
+        {
+            if (eof)
+                return !line.empty();
+            // 每次最多读一行，管道里有多少就处理多少，不会等缓冲区填满
+            buffer_pos = 0;
+            buffer_end = 0;
+            if (!std::fgets(&buffer[0], static_cast<int>(buffer.size()), fp))
+            {
+                if (std::ferror(fp))
+                    throw std::runtime_error("读取服务器列表时发生错误");
+                eof = true;
+                continue;
+            }
+            buffer_end = std::strlen(buffer.data());
+        }
+        const char *begin = buffer.data() + buffer_pos;
+        const char *end = buffer.data() + buffer_end;
+        const char *newline = static_cast<const char *>(std::memchr(begin, '\n', end - begin));
+        if (newline)
+        {
+            line.append(begin, newline);
+            buffer_pos += newline - begin + 1;
+            return true;
+        }
+        line.append(begin, end);
+        buffer_pos = buffer_end;
+    }
+}
+
+bool ServerListIO::Reader::Next(Endpoint_s &out)
+{
+    while (ReadLine())
+    {
+        ++line_number;
+        Trim(line);
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        bool ok = false;
+        switch (format)
+        {
+        case Format_e::Text: ok = ParseText(out); break;
+        case Format_e::CSV: ok = ParseCSV(out); break;
+        case Format_e::NDJSON: ok = ParseNDJSON(out); break;
+        }
+        first_record = false;
+        if (ok && !out.Host.empty())
+            return true;
+    }
+    return false;
+}
+
+bool ServerListIO::Reader::ParseText(Endpoint_s &out) const
+{
+    const char *end = line.data() + line.size();
+    SplitHostPort(line.data(), std::find_if(line.data(), end, IsSpace), out);
+    return true;
+}
+
+bool ServerListIO::Reader::ParseCSV(Endpoint_s &out)
+{
+    // 只取前两列，地址里不会出现引号和逗号
+    const char *begin = line.data();
+    const char *end = begin + line.size();
+    const char *comma = std::find(begin, end, ',');
+    const char *port_end = comma == end ? end : std::find(comma + 1, end, ',');
+
+    auto unquote = [](const char *&b, const char *&e) {
+        while (b < e && (IsSpace(*b) || *b == '"'))
+            ++b;
+        while (e > b && (IsSpace(e[-1]) || e[-1] == '"'))
+            --e;
+    };
+    const char *host_begin = begin, *host_end = comma;
+    unquote(host_begin, host_end);
+
+    // 表头，前面可以有空行和注释
+    if (first_record && (std::string_view(host_begin, host_end - host_begin) == "host" || std::string_view(host_begin, host_end - host_begin) == "address"))
+        return false;
+
+    if (comma == end)
+        return SplitHostPort(host_begin, host_end, out), true;
+
+    const char *port_begin = comma + 1;
+    unquote(port_begin, port_end);
+    if (port_begin == port_end)
+        return SplitHostPort(host_begin, host_end, out), true;
+    out.Host.assign(host_begin, host_end);
+    out.Port.assign(port_begin, port_end);
+    return true;
+}
+
+bool ServerListIO::Reader::ParseNDJSON(Endpoint_s &out)
+{
+    // 只支持一层的对象，其他字段忽略
+    std::size_t pos = line.find('{');
+    if (pos == std::string::npos)
+        return false;
+    ++pos;
+
+    bool has_port = false;
+    out.Host.clear();
+    while (pos < line.size())
+    {
+        while (pos < line.size() && (IsSpace(line[pos]) || line[pos] == ','))
+            ++pos;
+        if (pos >= line.size() || line[pos] == '}')
+            break;
+        if (line[pos] != '"' || !ReadJsonString(line, pos, key))
+            return false;
+        while (pos < line.size() && (IsSpace(line[pos]) || line[pos] == ':'))
+            ++pos;
+        if (pos >= line.size())
+            return false;
+        if (line[pos] == '"')
+        {
+            if (!ReadJsonString(line, pos, value))
+                return false;
+        }
+        else
+        {
+            std::size_t value_end = line.find_first_of(",}", pos);
+            value.assign(line, pos, value_end == std::string::npos ? std::string::npos : value_end - pos);
+            Trim(value);
+            pos = value_end == std::string::npos ? line.size() : value_end;
+        }
+
+        if (key == "host")
+            out.Host = value;
+        else if (key == "port")
+            out.Port = value, has_port = true;
+        else if (key == "address" && out.Host.empty())
+        {
+            SplitHostPort(value.data(), value.data() + value.size(), address);
+            out.Host = address.Host;
+            if (!has_port)
+                out.Port = address.Port, has_port = true;
+        }
+    }
+    if (!has_port)
+        out.Port.assign(DefaultPort);
+    return true;
+}
+
+ServerListIO::Writer::Writer(std::FILE *fp, Format_e format, std::size_t flush_threshold) : fp(fp), format(format), flush_threshold(flush_threshold)
+{
+    buffer.reserve(flush_threshold + 4096);
+}
+
+ServerListIO::Writer::~Writer()
+{
+    Flush();
+}
+
+void ServerListIO::Writer::WriteHeader()
+{
+    if (format != Format_e::CSV)
+        return;
+    std::lock_guard<std::mutex> lock(mtx);
+    for (const char *name : FieldNames)
+    {
+        if (name != FieldNames[0])
+            buffer.push_back(',');
+        buffer.append(name);
+    }
+    buffer.push_back('\n');
+}
+
+void ServerListIO::Writer::BeginRecord()
+{
+    first_field = true;
+    if (format == Format_e::NDJSON)
+        buffer.push_back('{');
+}
+
+void ServerListIO::Writer::AppendField(const char *key, const std::string &value)
+{
+    if (!first_field)
+        buffer.push_back(format == Format_e::Text ? '\t' : ',');
+    first_field = false;
+
+    switch (format)
+    {
+    case Format_e::Text:
+        AppendTextString(buffer, value);
+        break;
+    case Format_e::CSV:
+        AppendCsvString(buffer, value);
+        break;
+    case Format_e::NDJSON:
+        buffer.push_back('"');
+        buffer.append(key);
+        buffer.append("\":");
+        AppendJsonString(buffer, value);
+        break;
+    }
+}
+
+void ServerListIO::Writer::AppendField(const char *key, int64_t value)
+{
+    if (!first_field)
+        buffer.push_back(format == Format_e::Text ? '\t' : ',');
+    first_field = false;
+
+    if (format == Format_e::NDJSON)
+    {
+        buffer.push_back('"');
+        buffer.append(key);
+        buffer.append("\":");
+    }
+    char digits[24];
+    auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), value);
+    buffer.append(digits, end);
+}
+
+void ServerListIO::Writer::EndRecord()
+{
+    if (format == Format_e::NDJSON)
+        buffer.push_back('}');
+    buffer.push_back('\n');
+    FlushIfNeeded();
+}
+
+void ServerListIO::Writer::Write(const Endpoint_s &endpoint, const TSourceEngineQuery::ServerInfoQueryResult &result)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    BeginRecord();
+    AppendField("address", endpoint.Host);
+    AppendField("port", endpoint.Port);
+    AppendField("name", result.ServerName);
+    AppendField("map", result.Map);
+    AppendField("game", result.Game);
+    AppendField("folder", result.Folder);
+    AppendField("players", result.PlayerCount);
+    AppendField("max_players", result.MaxPlayers);
+    AppendField("bots", result.BotCount);
+    AppendField("protocol", result.Protocol);
+    AppendField("environment", EnvironmentName(result.Environment));
+    AppendField("vac", result.VAC);
+    if (format != Format_e::NDJSON)
+        AppendField("error", std::string());
+    EndRecord();
+}
+
+void ServerListIO::Writer::WriteError(const Endpoint_s &endpoint, const std::string &message)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    BeginRecord();
+    AppendField("address", endpoint.Host);
+    AppendField("port", endpoint.Port);
+    // 保持和正常结果一样的列数
+    if (format != Format_e::NDJSON)
+        buffer.append(std::size(FieldNames) - 3, format == Format_e::Text ? '\t' : ',');
+    AppendField("error", message);
+    EndRecord();
+}
+
+void ServerListIO::Writer::FlushIfNeeded()
+{
+    if (buffer.size() < flush_threshold)
+        return;
+    std::fwrite(buffer.data(), 1, buffer.size(), fp);
+    buffer.clear();
+}
+
+void ServerListIO::Writer::Flush()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    std::fwrite(buffer.data(), 1, buffer.size(), fp);
+    buffer.clear();
+    std::fflush(fp);
+}
+
+std::size_t ServerListIO::Sweep(Reader &reader, Writer &writer, std::size_t max_in_flight, std::chrono::seconds timeout)
+{
+    struct State {
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::size_t in_flight = 0;
+    };
+    std::shared_ptr<State> state = std::make_shared<State>();
+    max_in_flight = std::max<std::size_t>(max_in_flight, 1);
+
+    TSourceEngineQuery tseq;
+    std::size_t count = 0;
+    Endpoint_s endpoint;
+    std::exception_ptr read_error;
+    try {
+        while (reader.Next(endpoint))
+        {
+            {
+                std::unique_lock<std::mutex> lock(state->mtx);
+                state->cv.wait(lock, [&] { return state->in_flight < max_in_flight; });
+                ++state->in_flight;
+            }
+            ++count;
+            auto on_result = [state, &writer, endpoint](std::exception_ptr exc, TSourceEngineQuery::ServerInfoQueryResult result) {
+                try {
+                    if (exc)
+                        std::rethrow_exception(exc);
+                    writer.Write(endpoint, result);
+                } catch (const std::exception &e) {
+                    writer.WriteError(endpoint, e.what());
+                } catch (...) {
+                    writer.WriteError(endpoint, "未知错误");
+                }
+                {
+                    std::lock_guard<std::mutex> lock(state->mtx);
+                    --state->in_flight;
+                }
+                state->cv.notify_all();
+            };
+            try {
+                tseq.GetServerInfoDataAsync(endpoint.Host.c_str(), endpoint.Port.c_str(), timeout, on_result);
+            } catch (...) {
+                // 查询没能发起时回调不会被调用，这里补上，不然会一直等下去
+                on_result(std::current_exception(), {});
+            }
+        }
+    } catch (...) {
+        // 先等已经发出的查询写完结果再报告，回调里还在使用 writer
+        read_error = std::current_exception();
+    }
+
+    std::unique_lock<std::mutex> lock(state->mtx);
+    state->cv.wait(lock, [&] { return state->in_flight == 0; });
+    lock.unlock();
+    writer.Flush();
+    if (read_error)
+        std::rethrow_exception(read_error);
+    return count;
+}
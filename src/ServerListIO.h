@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <mutex>
+#include <chrono>
+
+#include "TSourceEngineQuery.h"
+
+// 服务器列表和查询结果的流式读写，全程只占用固定大小的缓冲区
+class ServerListIO
+{
+public:
+    enum class Format_e
+    {
+        Text, // 每行一个 host[:port]
+        CSV, // host,port，可以带表头
+        NDJSON, // 每行一个 {"host": "...", "port": 27015} 或 {"address": "host:port"}
+    };
+
+    static Format_e FormatFromFileName(const std::string &filename);
+
+    struct Endpoint_s
+    {
+        std::string Host;
+        std::string Port;
+    };
+
+    // 从文件或管道逐行读取服务器地址，不会把整个列表读进内存
+    class Reader
+    {
+    public:
+        Reader(std::FILE *fp, Format_e format);
+        Reader(const Reader &) = delete;
+        Reader &operator=(const Reader &) = delete;
+
+        // 读到下一个地址时返回 true，out 中的字符串会被复用，读取出错时抛出 std::runtime_error
+        bool Next(Endpoint_s &out);
+        std::size_t LineNumber() const { return line_number; }
+
+    private:
+        bool ReadLine();
+        bool ParseText(Endpoint_s &out) const;
+        bool ParseCSV(Endpoint_s &out);
+        bool ParseNDJSON(Endpoint_s &out);
+
+        std::FILE *const fp;
+        const Format_e format;
+        std::string buffer;
+        std::size_t buffer_pos = 0;
+        std::size_t buffer_end = 0;
+        std::string line;
+        std::size_t line_number = 0;
+        bool first_record = true;
+        bool eof = false;
+        // 解析 NDJSON 时复用，避免每行都分配
+        std::string key;
+        std::string value;
+        Endpoint_s address;
+    };
+
+    // 把查询结果写成同样的三种格式，可以在多个线程中同时调用
+    class Writer
+    {
+    public:
+        Writer(std::FILE *fp, Format_e format, std::size_t flush_threshold = 64 * 1024);
+        ~Writer();
+        Writer(const Writer &) = delete;
+        Writer &operator=(const Writer &) = delete;
+
+        void WriteHeader();
+        void Write(const Endpoint_s &endpoint, const TSourceEngineQuery::ServerInfoQueryResult &result);
+        void WriteError(const Endpoint_s &endpoint, const std::string &message);
+        void Flush();
+
+    private:
+        void BeginRecord();
+        void AppendField(const char *key, const std::string &value);
+        void AppendField(const char *key, int64_t value);
+        void EndRecord();
+        void FlushIfNeeded();
+
+        std::FILE *const fp;
+        const Format_e format;
+        const std::size_t flush_threshold;
+        std::mutex mtx;
+        std::string buffer;
+        bool first_field = true;
+    };
+
+    // 读取整个列表逐个查询并写出结果，同时进行的查询不超过 max_in_flight 个
+    // 会阻塞调用线程直到全部完成，不要在 io_context 线程上调用；读取列表出错时等已发出的查询写完后再抛出
+    static std::size_t Sweep(Reader &reader, Writer &writer, std::size_t max_in_flight, std::chrono::seconds timeout);
+};
@@ -2,16 +2,90 @@
 #include <memory>
 #include <boost/asio.hpp>
 #include <future>
+#include <atomic>
+#include <map>
+#include <list>
+#include <mutex>
+#include <cstring>
 
 #include "TSourceEngineQuery.h"
 #include "GlobalContext.h"
+#include "PacketPacer.h"
 #include "parsemsg.h"
 
 using namespace std::chrono_literals;
 using boost::asio::ip::udp;
 
+// 服务器信息查询使用的协议
+enum class ServerInfoDialect_e
+{
+    Unknown,
+    Source, // TSource Engine Query，Source 和 Steam 版 GoldSrc
+    GoldSrc, // details，WON 版 GoldSrc
+    Xash, // info，Xash3D
+};
+
+// 记住每个地址使用的协议，之后的查询只需要发一个包
+class ServerInfoDialectCache
+{
+public:
+    ServerInfoDialect_e Get(const udp::endpoint &endpoint)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto iter = index.find(endpoint);
+        if (iter == index.end())
+            return ServerInfoDialect_e::Unknown;
+        entries.splice(entries.begin(), entries, iter->second);
+        return iter->second->second;
+    }
+
+    void Set(const udp::endpoint &endpoint, ServerInfoDialect_e dialect)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (auto iter = index.find(endpoint); iter != index.end())
+        {
+            iter->second->second = dialect;
+            entries.splice(entries.begin(), entries, iter->second);
+            return;
+        }
+        // 满了只淘汰最久没用过的一个，大批量扫描时不会把记住的协议全部丢掉
+        if (entries.size() >= MaxEntries)
+        {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        entries.emplace_front(endpoint, dialect);
+        index.emplace(endpoint, entries.begin());
+    }
+
+    void Forget(const udp::endpoint &endpoint)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (auto iter = index.find(endpoint); iter != index.end())
+        {
+            entries.erase(iter->second);
+            index.erase(iter);
+        }
+    }
+
+private:
+    static constexpr std::size_t MaxEntries = 65536;
+    std::mutex mtx;
+    // 按最近使用的顺序排列，最前面是最近用过的
+    std::list<std::pair<udp::endpoint, ServerInfoDialect_e>> entries;
+    std::map<udp::endpoint, std::list<std::pair<udp::endpoint, ServerInfoDialect_e>>::iterator> index;
+};
+
+std::shared_ptr<ServerInfoDialectCache> GlobalServerInfoDialectCacheSingleton()
+{
+    static auto sp = std::make_shared<ServerInfoDialectCache>();
+    return sp;
+}
+
 struct TSourceEngineQuery::impl_t {
     std::shared_ptr<boost::asio::io_context> ioc = GlobalContextSingleton();
+    std::shared_ptr<PacketPacer> pacer = GlobalPacketPacerSingleton();
+    std::shared_ptr<ServerInfoDialectCache> dialects = GlobalServerInfoDialectCacheSingleton();
 };
 
 TSourceEngineQuery::TSourceEngineQuery() : pimpl(std::make_shared<impl_t>())
@@ -29,6 +103,23 @@ std::string UTF8_To_ANSI(const std::string &str)
     return str;
 }
 
+// 解析 \\key\\value 形式的 infostring
+std::map<std::string, std::string> ParseInfoString(const std::string &str)
+{
+    std::map<std::string, std::string> result;
+    std::size_t pos = 0;
+    while (pos < str.size() && str[pos] == '\\')
+    {
+        std::size_t key_end = str.find('\\', pos + 1);
+        if (key_end == std::string::npos)
+            break;
+        std::size_t value_end = std::min(str.find('\\', key_end + 1), str.find('\n', key_end + 1));
+        result[str.substr(pos + 1, key_end - pos - 1)] = str.substr(key_end + 1, value_end == std::string::npos ? std::string::npos : value_end - key_end - 1);
+        pos = value_end;
+    }
+    return result;
+}
+
 auto TSourceEngineQuery::MakeServerInfoQueryResultFromBuffer(const char *reply, std::size_t reply_length, std::string address, uint16_t port) -> ServerInfoQueryResult
 {
     BufferReader buf(reply, reply_length);
@@ -100,6 +191,30 @@ auto TSourceEngineQuery::MakeServerInfoQueryResultFromBuffer(const char *reply,
         result.VAC = buf.ReadByte();
         result.BotCount = buf.ReadByte();
     }
+    else if (result.header2 == 'i')
+    {
+        // Xash3D版，"info\n" 后面是 infostring
+        const std::string reply_string = buf.ReadString();
+        if (reply_string.compare(0, 4, "nfo\n") != 0)
+            throw std::runtime_error("不支持的服务器信息协议格式");
+
+        auto info = ParseInfoString(reply_string.substr(4));
+        if (!info.count("map"))
+            throw std::runtime_error("Xash3D服务器返回的信息不完整：" + UTF8_To_ANSI(info["host"]));
+
+        result.Protocol = static_cast<uint8_t>(std::atoi(info["p"].c_str()));
+        result.ServerName = UTF8_To_ANSI(info["host"]);
+        result.Map = UTF8_To_ANSI(info["map"]);
+        result.Folder = UTF8_To_ANSI(info["gamedir"]);
+        result.Game = UTF8_To_ANSI(info["gamedir"]);
+        result.PlayerCount = std::atoi(info["numcl"].c_str());
+        result.MaxPlayers = std::atoi(info["maxcl"].c_str());
+        result.BotCount = 0;
+        result.ServerType = ServerType_e{}; // Xash3D 不返回这两项
+        result.Environment = Environment_e{};
+        result.Visibility = info["password"].empty() || info["password"] == "0" ? Public : Private;
+        result.VAC = false;
+    }
     else
     {
         throw std::runtime_error("不支持的服务器信息协议格式");
@@ -145,8 +260,8 @@ auto TSourceEngineQuery::MakePlayerListQueryResultFromBuffer(const char *reply,
     return result;
 }
 
-template<class T>
-void try_set_exception(std::promise<T>& pro, std::exception_ptr exc)
+template<class Promise>
+void try_set_exception(Promise& pro, std::exception_ptr exc)
 {
     try {
         pro.set_exception(exc);
@@ -156,6 +271,45 @@ void try_set_exception(std::promise<T>& pro, std::exception_ptr exc)
     }
 }
 
+// 与 std::promise 接口一致，但结果只会交给回调一次
+template<class T>
+class CallbackPromise
+{
+public:
+    explicit CallbackPromise(TSourceEngineQuery::QueryHandler<T> fn) : handler(std::move(fn)) {}
+
+    void set_value(T value)
+    {
+        if (done.exchange(true))
+            throw std::future_error(std::future_errc::promise_already_satisfied);
+        handler(nullptr, std::move(value));
+    }
+
+    void set_exception(std::exception_ptr exc)
+    {
+        if (done.exchange(true))
+            throw std::future_error(std::future_errc::promise_already_satisfied);
+        handler(exc, T{});
+    }
+
+private:
+    std::atomic<bool> done{ false };
+    TSourceEngineQuery::QueryHandler<T> handler;
+};
+
+template<class T>
+std::future<T> MakeFutureQuery(const std::function<void(TSourceEngineQuery::QueryHandler<T>)> &query)
+{
+    std::shared_ptr<std::promise<T>> pro = std::make_shared<std::promise<T>>();
+    query([pro](std::exception_ptr exc, T result) {
+        if (exc)
+            pro->set_exception(exc);
+        else
+            pro->set_value(std::move(result));
+    });
+    return pro->get_future();
+}
+
 template<class Ret, class Handler, class NewRet = typename std::invoke_result<Handler, Ret>::type>
 std::future<NewRet> then(boost::asio::io_context & ioc, std::future<Ret> &fut, Handler fn)
 {
@@ -182,109 +336,343 @@ std::future<NewRet> then(boost::asio::io_context & ioc, std::future<Ret> &fut, H
 
 // Reference: https://developer.valvesoftware.com/wiki/Server_queries#A2S_INFO
 auto TSourceEngineQuery::GetServerInfoDataAsync(const char *host, const char *port, std::chrono::seconds timeout) -> std::future<ServerInfoQueryResult>
+{
+    return MakeFutureQuery<ServerInfoQueryResult>([&](QueryHandler<ServerInfoQueryResult> handler) {
+        GetServerInfoDataAsync(host, port, timeout, std::move(handler));
+    });
+}
+
+// 查询的截止时间，从第一个包真正发出时开始计时，排队等待发包时隙的时间不算在内
+// 只在查询自己的 strand 上使用
+class QueryDeadline : public std::enable_shared_from_this<QueryDeadline>
+{
+public:
+    QueryDeadline(const boost::asio::steady_timer::executor_type &ex, std::chrono::seconds timeout, std::function<void()> on_timeout)
+        : timer(ex), timeout(timeout), on_timeout(std::move(on_timeout))
+    {
+
+    }
+
+    // 只有第一次调用会开始计时
+    void Start()
+    {
+        if (started || !on_timeout)
+            return;
+        started = true;
+        timer.expires_after(timeout);
+        timer.async_wait([self = shared_from_this()](boost::system::error_code ec) {
+            if (ec || !self->on_timeout)
+                return;
+            std::function<void()> fn = std::move(self->on_timeout);
+            self->on_timeout = nullptr;
+            fn();
+        });
+    }
+
+    // 查询已经结束，不再触发超时
+    void Cancel()
+    {
+        on_timeout = nullptr;
+        timer.cancel();
+    }
+
+private:
+    boost::asio::steady_timer timer;
+    const std::chrono::seconds timeout;
+    std::function<void()> on_timeout;
+    bool started = false;
+};
+
+// 不抛异常地打开一个绑定到任意端口的 socket，文件描述符用完时返回错误
+boost::system::error_code OpenQuerySocket(udp::socket &socket)
+{
+    boost::system::error_code ec;
+    socket.open(udp::v4(), ec);
+    if (!ec)
+        socket.bind(udp::endpoint(udp::v4(), 0), ec);
+    return ec;
+}
+
+boost::asio::const_buffer MakeServerInfoRequest(ServerInfoDialect_e dialect)
+{
+    static constexpr char request1[] = "\xFF\xFF\xFF\xFF" "TSource Engine Query"; // Source / GoldSrc Steam
+    static constexpr char request2[] = "\xFF\xFF\xFF\xFF" "details"; // GoldSrc WON
+    static constexpr char request3[] = "\xFF\xFF\xFF\xFF" "info 49"; // Xash3D，49为协议版本
+
+    switch (dialect)
+    {
+    case ServerInfoDialect_e::GoldSrc:
+        return boost::asio::buffer(request2, sizeof(request2));
+    case ServerInfoDialect_e::Xash:
+        return boost::asio::buffer(request3, sizeof(request3));
+    default:
+        return boost::asio::buffer(request1, sizeof(request1));
+    }
+}
+
+// 只看头部判断回复是否对应发出的请求，和调用方用什么方式解析无关
+bool IsServerInfoReply(ServerInfoDialect_e dialect, const char *reply, std::size_t reply_length)
+{
+    if (reply_length < 5 || std::memcmp(reply, "\xFF\xFF\xFF\xFF", 4) != 0)
+        return false;
+
+    switch (dialect)
+    {
+    case ServerInfoDialect_e::GoldSrc:
+        return reply[4] == 'm';
+    case ServerInfoDialect_e::Xash:
+        return reply_length >= 9 && std::memcmp(reply + 4, "info\n", 5) == 0;
+    default:
+        // 非Steam版服务器对 Source 请求也可能回复 'm'
+        return reply[4] == 'I' || reply[4] == 'm';
+    }
+}
+
+void TSourceEngineQuery::GetServerInfoDataAsync(const char *host, const char *port, std::chrono::seconds timeout, QueryHandler<ServerInfoQueryResult> handler)
+{
+    std::shared_ptr<CallbackPromise<ServerInfoQueryResult>> pro = std::make_shared<CallbackPromise<ServerInfoQueryResult>>(std::move(handler));
+    GetServerInfoReplyAsync(host, port, timeout, [pro](const char *reply, std::size_t reply_length, const std::string &address, uint16_t port) {
+        ServerInfoQueryResult result = MakeServerInfoQueryResultFromBuffer(reply, reply_length, address, port);
+        try{
+            pro->set_value(std::move(result));
+        } catch(std::future_error&) {
+            // 其他协议的回复先到了
+        }
+    }, [pro](std::exception_ptr exc) {
+        try_set_exception(*pro, exc);
+    });
+}
+
+void TSourceEngineQuery::GetServerInfoReplyAsync(const char *host, const char *port, std::chrono::seconds timeout, ReplyParser parser, std::function<void(std::exception_ptr)> on_error)
 {
     // 发送查询包
-    std::shared_ptr<std::promise<ServerInfoQueryResult>> pro = std::make_shared<std::promise<ServerInfoQueryResult>>();
+    std::shared_ptr<CallbackPromise<bool>> pro = std::make_shared<CallbackPromise<bool>>([on_error = std::move(on_error)](std::exception_ptr exc, bool) {
+        if (exc)
+            on_error(exc);
+    });
+    std::shared_ptr<ReplyParser> parse = std::make_shared<ReplyParser>(std::move(parser));
     std::shared_ptr<boost::asio::io_context> ioc = pimpl->ioc;
-    std::shared_ptr<udp::resolver> resolver = std::make_shared<udp::resolver>(*ioc);
+    std::shared_ptr<PacketPacer> pacer = pimpl->pacer;
+    std::shared_ptr<ServerInfoDialectCache> dialects = pimpl->dialects;
+    // 同一个查询的所有回调都在这个 strand 上执行，结束时可以安全地关闭 socket
+    auto strand = boost::asio::make_strand(*ioc);
+    std::shared_ptr<udp::resolver> resolver = std::make_shared<udp::resolver>(strand);
     
-    resolver->async_resolve(udp::v4(), host, port, [resolver, ioc, pro, timeout](boost::system::error_code ec, udp::resolver::results_type endpoints) {
+    resolver->async_resolve(udp::v4(), host, port, [resolver, strand, pacer, dialects, parse, pro, timeout](boost::system::error_code ec, udp::resolver::results_type endpoints) {
         if(ec)
             return try_set_exception(*pro, std::make_exception_ptr(boost::system::system_error(ec, "解析域名时发生错误"))), void();
 
-        std::shared_ptr<udp::socket> socket = std::make_shared<udp::socket>(*ioc, udp::endpoint(udp::v4(), 0));
-        for(auto &&endpoint : endpoints)
+        // 已知协议的地址只发一个包，未知的同时试探所有协议
+        // 每种协议用单独的socket，这样收到回复就知道对方回应的是哪个请求
+        struct Probe_s
+        {
+            udp::endpoint endpoint;
+            ServerInfoDialect_e dialect;
+            std::shared_ptr<udp::socket> socket;
+        };
+        std::vector<Probe_s> probes;
+        for(auto &&entry : endpoints)
         {
-            static constexpr char request1[] = "\xFF\xFF\xFF\xFF" "TSource Engine Query"; // Source / GoldSrc Steam
-            //static constexpr char request2[] = "\xFF\xFF\xFF\xFF" "details"; // GoldSrc WON
-            //static constexpr char request3[] = "\xFF\xFF\xFF\xFF" "info"; // Xash3D
+            const udp::endpoint endpoint = entry;
+            if (ServerInfoDialect_e known = dialects->Get(endpoint); known != ServerInfoDialect_e::Unknown)
+                probes.push_back({ endpoint, known, std::make_shared<udp::socket>(strand) });
+            else
+                for (ServerInfoDialect_e dialect : { ServerInfoDialect_e::Source, ServerInfoDialect_e::GoldSrc, ServerInfoDialect_e::Xash })
+                    probes.push_back({ endpoint, dialect, std::make_shared<udp::socket>(strand) });
+        }
 
-            socket->async_send_to(boost::asio::buffer(request1, sizeof(request1)), endpoint, [socket, endpoint, pro](boost::system::error_code ec, std::size_t bytes_transferred) {
+        if (probes.empty())
+            return try_set_exception(*pro, std::make_exception_ptr(boost::system::system_error(boost::asio::error::make_error_code(boost::asio::error::host_not_found), "解析域名时发生错误"))), void();
+
+        std::shared_ptr<std::atomic<bool>> answered = std::make_shared<std::atomic<bool>>(false);
+        std::shared_ptr<QueryDeadline> ddl = std::make_shared<QueryDeadline>(strand, timeout, [probes, dialects, answered, pro]() {
+            try_set_exception(*pro, std::make_exception_ptr(boost::system::system_error(boost::asio::error::make_error_code(boost::asio::error::timed_out), "查询服务器超时，可能是服务器挂了或者IP不正确。")));
+            for (auto &probe : probes)
+            {
+                // 记住的协议不再有效，下次重新试探
+                if (!*answered)
+                    dialects->Forget(probe.endpoint);
+                boost::system::error_code ec;
+                probe.socket->close(ec);
+            }
+        });
+
+        // 查询结束（收到回复或全部失败）时立即释放 socket 和定时器
+        std::shared_ptr<std::atomic<bool>> finished = std::make_shared<std::atomic<bool>>(false);
+        auto release = [probes, ddl, finished]() {
+            if (finished->exchange(true))
+                return;
+            ddl->Cancel();
+            for (auto &probe : probes)
+            {
+                boost::system::error_code ec;
+                probe.socket->close(ec);
+            }
+        };
+
+        // 所有试探都失败时才报告错误，否则等到超时
+        std::shared_ptr<std::atomic<std::size_t>> pending = std::make_shared<std::atomic<std::size_t>>(probes.size());
+        auto fail = [pending, release, pro](std::exception_ptr exc) {
+            if (--*pending != 0)
+                return;
+            try_set_exception(*pro, exc);
+            release();
+        };
+
+        for(auto &probe : probes)
+        {
+            // 等待发包时隙，避免突发
+            pacer->AsyncWait(probe.endpoint, strand, [socket = probe.socket, endpoint = probe.endpoint, dialect = probe.dialect, dialects, parse, answered, finished, release, fail, ddl, pro](boost::system::error_code ec) {
                 if(ec)
-                    return try_set_exception(*pro, std::make_exception_ptr(boost::system::system_error(ec, "发送服务器信息查询包时发生错误"))), void();
-                std::shared_ptr<char> buffer(new char[8192], std::default_delete<char[]>());
-                std::shared_ptr<udp::endpoint> sender_endpoint = std::make_shared<udp::endpoint>(udp::v4(), 0);
-                socket->async_receive_from(boost::asio::buffer(buffer.get(), 8192), *sender_endpoint, [socket, buffer, sender_endpoint, pro](boost::system::error_code ec, std::size_t reply_length) {
-                    if (ec)
-                        return try_set_exception(*pro, std::make_exception_ptr(boost::system::system_error(ec, "接收服务器信息查询包时发生错误"))), void();
-
-                    try{
-                        return pro->set_value(MakeServerInfoQueryResultFromBuffer(buffer.get(), reply_length, sender_endpoint->address().to_string(), sender_endpoint->port())), void();
-                    } catch(...) {
-                        return try_set_exception(*pro, std::current_exception()), void();
-                    }
+                    return fail(std::make_exception_ptr(boost::system::system_error(ec, "等待发包时隙时发生错误")));
+                // 其他协议已经先回复了，不用再发
+                if (*finished)
+                    return;
+                // 到了发包时隙才打开 socket，排队中的查询不占用文件描述符
+                if (boost::system::error_code open_ec = OpenQuerySocket(*socket))
+                    return fail(std::make_exception_ptr(boost::system::system_error(open_ec, "创建查询socket时发生错误")));
+                ddl->Start();
+                socket->async_send_to(MakeServerInfoRequest(dialect), endpoint, [socket, endpoint, dialect, dialects, parse, answered, release, fail, pro](boost::system::error_code ec, std::size_t bytes_transferred) {
+                    if(ec)
+                        return fail(std::make_exception_ptr(boost::system::system_error(ec, "发送服务器信息查询包时发生错误")));
+                    std::shared_ptr<char> buffer(new char[8192], std::default_delete<char[]>());
+                    std::shared_ptr<udp::endpoint> sender_endpoint = std::make_shared<udp::endpoint>(udp::v4(), 0);
+                    socket->async_receive_from(boost::asio::buffer(buffer.get(), 8192), *sender_endpoint, [socket, endpoint, dialect, dialects, parse, answered, release, fail, buffer, sender_endpoint, pro](boost::system::error_code ec, std::size_t reply_length) {
+                        if (ec)
+                            return fail(std::make_exception_ptr(boost::system::system_error(ec, "接收服务器信息查询包时发生错误")));
+                        if (*answered)
+                            return;
+                        if (!IsServerInfoReply(dialect, buffer.get(), reply_length))
+                            return fail(std::make_exception_ptr(std::runtime_error("不支持的服务器信息协议格式")));
+
+                        try{
+                            (*parse)(buffer.get(), reply_length, sender_endpoint->address().to_string(), sender_endpoint->port());
+                        } catch(...) {
+                            return fail(std::current_exception());
+                        }
+                        // 只有第一个解析成功的回复被接受，也只有它能记住协议
+                        if (answered->exchange(true))
+                            return;
+                        dialects->Set(endpoint, dialect);
+                        try{
+                            pro->set_value(true);
+                        } catch(std::future_error&) {
+                            // 其他协议的回复先到了
+                        }
+                        release();
+                    });
                 });
             });
         }
-
-        std::shared_ptr<boost::asio::system_timer> ddl = std::make_shared<boost::asio::system_timer>(*ioc);
-        ddl->expires_from_now(timeout);
-        ddl->async_wait([ioc, socket, pro, ddl](boost::system::error_code ec){
-            socket->close(ec);
-            return try_set_exception(*pro, std::make_exception_ptr(boost::system::system_error(boost::asio::error::make_error_code(boost::asio::error::timed_out), "查询服务器超时，可能是服务器挂了或者IP不正确。"))), void();
-        });
     });
-    return pro->get_future();
 }
 
 auto TSourceEngineQuery::GetPlayerListDataAsync(const char *host, const char *port, std::chrono::seconds timeout) -> std::future<PlayerListQueryResult>
 {
-    std::shared_ptr<std::promise<PlayerListQueryResult>> pro = std::make_shared<std::promise<PlayerListQueryResult>>();
+    return MakeFutureQuery<PlayerListQueryResult>([&](QueryHandler<PlayerListQueryResult> handler) {
+        GetPlayerListDataAsync(host, port, timeout, std::move(handler));
+    });
+}
+
+void TSourceEngineQuery::GetPlayerListDataAsync(const char *host, const char *port, std::chrono::seconds timeout, QueryHandler<PlayerListQueryResult> handler)
+{
+    std::shared_ptr<CallbackPromise<PlayerListQueryResult>> pro = std::make_shared<CallbackPromise<PlayerListQueryResult>>(std::move(handler));
     std::shared_ptr<boost::asio::io_context> ioc = pimpl->ioc;
-    std::shared_ptr<udp::resolver> resolver = std::make_shared<udp::resolver>(*ioc);
+    std::shared_ptr<PacketPacer> pacer = pimpl->pacer;
+    // 同一个查询的所有回调都在这个 strand 上执行，结束时可以安全地关闭 socket
+    auto strand = boost::asio::make_strand(*ioc);
+    std::shared_ptr<udp::resolver> resolver = std::make_shared<udp::resolver>(strand);
 
-    resolver->async_resolve(udp::v4(), host, port, [resolver, ioc, pro, timeout](boost::system::error_code ec, udp::resolver::results_type endpoints) {
+    resolver->async_resolve(udp::v4(), host, port, [resolver, strand, pacer, pro, timeout](boost::system::error_code ec, udp::resolver::results_type endpoints) {
         if(ec)
             return try_set_exception(*pro, std::make_exception_ptr(boost::system::system_error(ec, "解析域名时发生错误"))), void();
-        std::shared_ptr<udp::socket> socket = std::make_shared<udp::socket>(*ioc, udp::endpoint(udp::v4(), 0));
+        if (endpoints.empty())
+            return try_set_exception(*pro, std::make_exception_ptr(boost::system::system_error(boost::asio::error::make_error_code(boost::asio::error::host_not_found), "解析域名时发生错误"))), void();
+        std::shared_ptr<udp::socket> socket = std::make_shared<udp::socket>(strand);
+        std::shared_ptr<std::atomic<bool>> finished = std::make_shared<std::atomic<bool>>(false);
+
+        std::shared_ptr<QueryDeadline> ddl = std::make_shared<QueryDeadline>(strand, timeout, [socket, finished, pro]() {
+            *finished = true;
+            try_set_exception(*pro, std::make_exception_ptr(boost::system::system_error(boost::asio::error::make_error_code(boost::asio::error::timed_out), "查询服务器超时，可能是服务器挂了或者IP不正确。")));
+            boost::system::error_code ec;
+            socket->close(ec);
+        });
+
+        // 有结果或者出错时立即释放 socket 和定时器
+        auto set_value = [socket, ddl, finished, pro](PlayerListQueryResult result) {
+            *finished = true;
+            try{
+                pro->set_value(std::move(result));
+            } catch(std::future_error&) {
+                // 已经有结果了
+            }
+            ddl->Cancel();
+            boost::system::error_code ec;
+            socket->close(ec);
+        };
+        auto set_exception = [socket, ddl, finished, pro](std::exception_ptr exc) {
+            *finished = true;
+            try_set_exception(*pro, exc);
+            ddl->Cancel();
+            boost::system::error_code ec;
+            socket->close(ec);
+        };
+
         for(auto &&endpoint : endpoints)
         {
             // first attempt
-            constexpr char request_challenge[] = "\xFF\xFF\xFF\xFF" "U" "\xFF\xFF\xFF\xFF";
-            socket->async_send_to(boost::asio::buffer(request_challenge, sizeof(request_challenge)), endpoint, [socket, endpoint, pro](boost::system::error_code ec, std::size_t bytes_transferred) {
+            static constexpr char request_challenge[] = "\xFF\xFF\xFF\xFF" "U" "\xFF\xFF\xFF\xFF";
+            pacer->AsyncWait(endpoint, strand, [socket, ddl, finished, set_value, set_exception, endpoint = udp::endpoint(endpoint)](boost::system::error_code ec) {
                 if(ec)
-                    return try_set_exception(*pro, std::make_exception_ptr(boost::system::system_error(ec, "发送玩家查询包时发生错误"))), void();
-                std::shared_ptr<char> buffer(new char[4096], std::default_delete<char[]>());
-                std::shared_ptr<udp::endpoint> sender_endpoint = std::make_shared<udp::endpoint>(udp::v4(), 0);
-                socket->async_receive_from(boost::asio::buffer(buffer.get(), 4096), *sender_endpoint, [socket, endpoint, buffer, sender_endpoint, pro](boost::system::error_code ec, std::size_t reply_length) {
-                    if (ec)
-                        return try_set_exception(*pro, std::make_exception_ptr(boost::system::system_error(ec, "无法接收玩家查询包"))), void();
-
-                    PlayerListQueryResult first_result;
-                    try{
-                        first_result = MakePlayerListQueryResultFromBuffer(buffer.get(), reply_length, sender_endpoint->address().to_string(), sender_endpoint->port());
-                        if(first_result.Results.index() == 1)
-                            return pro->set_value(first_result), void();
-                    } catch(...) {
-                        return try_set_exception(*pro, std::current_exception()), void();
-                    }
-
-                    // second attempt
-                    const int32_t challenge = std::get<int32_t>(first_result.Results);
-                    const char(&accessor)[4] = reinterpret_cast<const char(&)[4]>(challenge);
-                    char request3[10] = { '\xFF', '\xFF', '\xFF', '\xFF', 'U', accessor[0], accessor[1], accessor[2], accessor[3], '\0' };
-                    socket->async_send_to(boost::asio::buffer(request3, sizeof(request3)), endpoint, [socket, buffer, sender_endpoint, endpoint, pro](boost::system::error_code ec, std::size_t bytes_transferred) {
+                    return set_exception(std::make_exception_ptr(boost::system::system_error(ec, "等待发包时隙时发生错误")));
+                if (*finished)
+                    return;
+                // 到了发包时隙才打开 socket，排队中的查询不占用文件描述符
+                if (!socket->is_open())
+                    if (boost::system::error_code open_ec = OpenQuerySocket(*socket))
+                        return set_exception(std::make_exception_ptr(boost::system::system_error(open_ec, "创建查询socket时发生错误")));
+                ddl->Start();
+                socket->async_send_to(boost::asio::buffer(request_challenge, sizeof(request_challenge)), endpoint, [socket, endpoint, set_value, set_exception](boost::system::error_code ec, std::size_t bytes_transferred) {
+                    if(ec)
+                        return set_exception(std::make_exception_ptr(boost::system::system_error(ec, "发送玩家查询包时发生错误")));
+                    std::shared_ptr<char> buffer(new char[4096], std::default_delete<char[]>());
+                    std::shared_ptr<udp::endpoint> sender_endpoint = std::make_shared<udp::endpoint>(udp::v4(), 0);
+                    socket->async_receive_from(boost::asio::buffer(buffer.get(), 4096), *sender_endpoint, [socket, endpoint, buffer, sender_endpoint, set_value, set_exception](boost::system::error_code ec, std::size_t reply_length) {
                         if (ec)
-                            return try_set_exception(*pro, std::make_exception_ptr(boost::system::system_error(ec, "发送challenge玩家查询包时发生错误"))), void();
-                        socket->async_receive_from(boost::asio::buffer(buffer.get(), 4096), *sender_endpoint, [socket, endpoint, buffer, sender_endpoint, pro](boost::system::error_code ec, std::size_t reply_length) {
+                            return set_exception(std::make_exception_ptr(boost::system::system_error(ec, "无法接收玩家查询包")));
+
+                        PlayerListQueryResult first_result;
+                        try{
+                            first_result = MakePlayerListQueryResultFromBuffer(buffer.get(), reply_length, sender_endpoint->address().to_string(), sender_endpoint->port());
+                        } catch(...) {
+                            return set_exception(std::current_exception());
+                        }
+                        if(first_result.Results.index() == 1)
+                            return set_value(std::move(first_result));
+
+                        // second attempt
+                        const int32_t challenge = std::get<int32_t>(first_result.Results);
+                        const char(&accessor)[4] = reinterpret_cast<const char(&)[4]>(challenge);
+                        // challenge 回复是服务器要求的，立即发送，不再排队等待发包时隙，否则在扇出时会排到超时之后
+                        // 发送完成前请求包需要一直有效
+                        std::shared_ptr<std::array<char, 10>> request3 = std::make_shared<std::array<char, 10>>(std::array<char, 10>{ '\xFF', '\xFF', '\xFF', '\xFF', 'U', accessor[0], accessor[1], accessor[2], accessor[3], '\0' });
+                        socket->async_send_to(boost::asio::buffer(*request3), endpoint, [socket, request3, buffer, sender_endpoint, endpoint, set_value, set_exception](boost::system::error_code ec, std::size_t bytes_transferred) {
                             if (ec)
-                                return try_set_exception(*pro, std::make_exception_ptr(boost::system::system_error(ec, "无法接收challenge玩家查询包"))), void();
-                            try{
-                                return pro->set_value(MakePlayerListQueryResultFromBuffer(buffer.get(), reply_length, sender_endpoint->address().to_string(), sender_endpoint->port())), void();
-                            } catch(...) {
-                                return try_set_exception(*pro, std::current_exception()), void();
-                            }
+                                return set_exception(std::make_exception_ptr(boost::system::system_error(ec, "发送challenge玩家查询包时发生错误")));
+                            socket->async_receive_from(boost::asio::buffer(buffer.get(), 4096), *sender_endpoint, [socket, endpoint, buffer, sender_endpoint, set_value, set_exception](boost::system::error_code ec, std::size_t reply_length) {
+                                if (ec)
+                                    return set_exception(std::make_exception_ptr(boost::system::system_error(ec, "无法接收challenge玩家查询包")));
+                                try{
+                                    PlayerListQueryResult result = MakePlayerListQueryResultFromBuffer(buffer.get(), reply_length, sender_endpoint->address().to_string(), sender_endpoint->port());
+                                    return set_value(std::move(result));
+                                } catch(...) {
+                                    return set_exception(std::current_exception());
+                                }
+                            });
                         });
                     });
                 });
             });
         }
-        std::shared_ptr<boost::asio::system_timer> ddl = std::make_shared<boost::asio::system_timer>(*ioc);
-        ddl->expires_from_now(timeout);
-        ddl->async_wait([ioc, socket, pro, ddl](boost::system::error_code ec){
-            socket->close(ec);
-            return try_set_exception(*pro, std::make_exception_ptr(boost::system::system_error(boost::asio::error::make_error_code(boost::asio::error::timed_out), "查询服务器超时，可能是服务器挂了或者IP不正确。"))), void();
-        });
     });
-    return pro->get_future();
 }
\ No newline at end of file
@@ -6,6 +6,8 @@
 #include <optional>
 #include <variant>
 #include <future>
+#include <functional>
+#include <exception>
 
 class TSourceEngineQuery
 {
@@ -114,10 +116,21 @@ public:
         std::variant<int32_t, std::vector<PlayerInfo_s>> Results;
     };
 
+    // 查询完成时在 io_context 线程上调用，出错时 exception_ptr 非空
+    template<class T>
+    using QueryHandler = std::function<void(std::exception_ptr, T)>;
+
     TSourceEngineQuery();
     ~TSourceEngineQuery();
     std::future<ServerInfoQueryResult> GetServerInfoDataAsync(const char *host, const char *port, std::chrono::seconds timeout);
     std::future<PlayerListQueryResult> GetPlayerListDataAsync(const char *host, const char *port, std::chrono::seconds timeout);
+    void GetServerInfoDataAsync(const char *host, const char *port, std::chrono::seconds timeout, QueryHandler<ServerInfoQueryResult> handler);
+    void GetPlayerListDataAsync(const char *host, const char *port, std::chrono::seconds timeout, QueryHandler<PlayerListQueryResult> handler);
+
+    // 收到的服务器信息回复原样交给 parser，缓冲区只在调用期间有效
+    // parser 抛出异常表示回复无效，会继续等待其他协议的回复
+    using ReplyParser = std::function<void(const char *reply, std::size_t reply_length, const std::string &address, uint16_t port)>;
+    void GetServerInfoReplyAsync(const char *host, const char *port, std::chrono::seconds timeout, ReplyParser parser, std::function<void(std::exception_ptr)> on_error);
 
 public:
     static ServerInfoQueryResult MakeServerInfoQueryResultFromBuffer(const char *reply, std::size_t reply_length, std::string address, uint16_t port);
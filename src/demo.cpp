@@ -2,6 +2,10 @@
 #include <set>
 #include <sstream>
 #include <regex>
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <functional>
 
 #include <cqcppsdk/cqcppsdk.h>
 #include "TSourceEngineQuery.h"
@@ -9,37 +13,105 @@
 using namespace cq;
 using namespace std::chrono_literals;
 
-std::string QueryServerInfo(const std::string &host, const std::string &port) noexcept(false) {
-    try {
-        TSourceEngineQuery tseq;
-        auto finfo = tseq.GetServerInfoDataAsync(host.c_str(), port.c_str(), 2s);
-        auto fplayer = tseq.GetPlayerListDataAsync(host.c_str(), port.c_str(), 2s);
-        auto result = finfo.get(); // try
-        std::ostringstream oss;
-        oss << result.ServerName << std::endl;
-        oss << "\t" << result.Map << " (" << result.PlayerCount << "/" << result.MaxPlayers << ") - "
-            << result.FromAddress << ":" << result.FromPort << std::endl;
-        oss << "\t" << result.Game << " / " << int(result.Protocol) << " / " << EnvironmentName(result.Environment)
-            << std::endl;
-
-        std::string myReply = oss.str();
+// 同时进行中的查询上限，超出的请求直接拒绝，避免一波查询拖住整个消息处理
+constexpr int MaxInFlightQueries = 32;
+std::atomic<int> InFlightQueries{ 0 };
+
+std::string FormatServerInfo(const TSourceEngineQuery::ServerInfoQueryResult &result, const std::optional<TSourceEngineQuery::PlayerListQueryResult> &players)
+{
+    std::ostringstream oss;
+    oss << result.ServerName << std::endl;
+    oss << "\t" << result.Map << " (" << result.PlayerCount << "/" << result.MaxPlayers << ") - "
+        << result.FromAddress << ":" << result.FromPort << std::endl;
+    oss << "\t" << result.Game << " / " << int(result.Protocol) << " / " << EnvironmentName(result.Environment)
+        << std::endl;
+
+    std::string myReply = oss.str();
+    if (players && players->Results.index() == 1) {
+        for (const auto &player : std::get<1>(players->Results)) {
+            myReply += player.Name;
+            myReply += " [";
+            myReply += std::to_string(player.Score) + "分";
+            // int duration = static_cast<int>(player.Duration);
+            // myReply += std::to_string(duration / 60) + ":" + std::to_string(duration % 60);
+            myReply += "] / ";
+        }
+    }
+    return myReply;
+}
+
+// 同时查询服务器信息和玩家列表，两者都结束后在 io_context 线程上回调
+// callback 只会调用一次，发起查询时的异常也通过 callback 报告
+void QueryServerInfoAsync(const std::string &host, const std::string &port, std::function<void(std::string)> callback) noexcept {
+    struct State {
+        std::mutex mtx;
+        int pending = 2;
+        std::atomic<bool> replied{ false };
+        std::exception_ptr info_exc;
+        TSourceEngineQuery::ServerInfoQueryResult info;
+        std::optional<TSourceEngineQuery::PlayerListQueryResult> players;
+        std::function<void(std::string)> callback;
+    };
+    std::shared_ptr<State> state;
+
+    auto reply_once = [](State &st, std::string reply) {
+        if (!st.replied.exchange(true))
+            st.callback(std::move(reply));
+    };
+
+    auto finish = [reply_once](State &st) {
+        std::string reply;
         try {
-            auto playerlist = std::get<1>(fplayer.get().Results);
-            for (const auto &player : playerlist) {
-                myReply += player.Name;
-                myReply += " [";
-                myReply += std::to_string(player.Score) + "分";
-                // int duration = static_cast<int>(player.Duration);
-                // myReply += std::to_string(duration / 60) + ":" + std::to_string(duration % 60);
-                myReply += "] / ";
-            }
+            if (st.info_exc)
+                std::rethrow_exception(st.info_exc);
+            reply = FormatServerInfo(st.info, st.players);
+        } catch (const std::exception &e) {
+            reply = e.what();
         } catch (...) {
+            reply = "服务器未响应。";
         }
-        return myReply;
+        reply_once(st, std::move(reply));
+    };
+
+    // 查询没能发起时直接回复，State 都没创建成功时 callback 还没有被移走
+    auto reply_failure = [&state, &callback, reply_once](std::string reply) {
+        if (state)
+            reply_once(*state, std::move(reply));
+        else
+            callback(std::move(reply));
+    };
+
+    try {
+        state = std::make_shared<State>();
+        state->callback = std::move(callback);
+
+        TSourceEngineQuery tseq;
+        tseq.GetServerInfoDataAsync(host.c_str(), port.c_str(), 2s, [state, finish](std::exception_ptr exc, TSourceEngineQuery::ServerInfoQueryResult result) {
+            {
+                std::lock_guard<std::mutex> lock(state->mtx);
+                state->info_exc = exc;
+                state->info = std::move(result);
+                if (--state->pending)
+                    return;
+            }
+            finish(*state);
+        });
+        tseq.GetPlayerListDataAsync(host.c_str(), port.c_str(), 2s, [state, finish](std::exception_ptr exc, TSourceEngineQuery::PlayerListQueryResult result) {
+            {
+                std::lock_guard<std::mutex> lock(state->mtx);
+                if (!exc)
+                    state->players = std::move(result);
+                if (--state->pending)
+                    return;
+            }
+            finish(*state);
+        });
     } catch (const std::exception &e) {
-        return e.what();
+        // 可能已经发出了一个查询，reply_once 保证不会重复回复
+        reply_failure(e.what());
+    } catch (...) {
+        reply_failure("服务器未响应。");
     }
-    return "服务器未响应。";
 }
 
 std::pair<std::string, std::string> ParseHostPort(const std::string &msg)
@@ -69,27 +141,50 @@ std::pair<std::string, std::string> ParseHostPort(const std::string &msg)
     return ret;
 }
 
-std::string ParseServerQueryMessage(const std::string &msg) try
+// 是查询命令时返回 true，回复会在查询结束后异步交给 callback
+bool ParseServerQueryMessageAsync(const std::string &msg, std::function<void(std::string)> callback) try
 {
     if (auto [host, port] = ParseHostPort(msg); !host.empty())
     {
-        return QueryServerInfo(host.c_str(), port.c_str());
+        QueryServerInfoAsync(host, port, std::move(callback));
+        return true;
     }
-    return {};
+    return false;
 }
 catch (const std::exception &e)
 {
-    return e.what();
+    callback(e.what());
+    return true;
 }
 
 CQ_INIT {
     on_enable([] { logging::info("启用", "插件已启用"); });
 
     on_message([](const MessageEvent &e) {
-        if(std::string reply = ParseServerQueryMessage(e.message); !reply.empty())
+        if (++InFlightQueries > MaxInFlightQueries)
         {
-            send_message(e.target, reply);
-            e.block(); // 阻止当前事件传递到下一个插件
+            --InFlightQueries;
+            if (!ParseHostPort(e.message).first.empty())
+            {
+                send_message(e.target, "查询的人太多了，请稍后再试。");
+                e.block();
+            }
+            return;
         }
+
+        bool is_query = ParseServerQueryMessageAsync(e.message, [target = e.target](std::string reply) {
+            // 在 io_context 线程上执行，异常不能漏出去
+            try {
+                send_message(target, reply);
+            } catch (const std::exception &ex) {
+                logging::warning("查询", ex.what());
+            }
+            --InFlightQueries;
+        });
+
+        if (is_query)
+            e.block(); // 阻止当前事件传递到下一个插件
+        else
+            --InFlightQueries;
     });
 }
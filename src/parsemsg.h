@@ -16,6 +16,8 @@
 //  parsemsg.h
 //
 
+#include <string>
+
 #define ASSERT( x )
 
 class BufferReader
@@ -33,7 +35,7 @@ public:
     int16_t ReadShort(void);
     int16_t ReadWord(void);
     int32_t ReadLong(void); // no mistake here, we assume that long is 32 bit.
-    char *ReadString(void);
+    std::string ReadString(void); // 不使用共享缓冲区，可以在多个线程中同时解析
     float ReadFloat(void);
     float ReadCoord(void);
     float ReadAngle(void);
@@ -74,15 +76,14 @@ inline T BufferReader::Read(void)
 
 
 template<>
-inline char* BufferReader::Read(void)
+inline std::string BufferReader::Read(void)
 {
-    static char string[2048];
+    std::string string;
 
     if (m_bBad)
-        return (char*)""; // do not return NULL, may break strcpy's
+        return string;
 
-    size_t l;
-    for (l = 0; l < sizeof(string) - 1; l++)
+    while (string.size() < 2047)
     {
         if (m_iRead > m_iSize)
             break;
@@ -91,10 +92,21 @@ inline char* BufferReader::Read(void)
         if (c == -1 || c == 0)
             break;
 
-        string[l] = c;
+        string.push_back(c);
     }
 
-    string[l] = 0;
+    return string;
+}
+
+template<>
+inline char* BufferReader::Read(void)
+{
+    // 兼容旧接口，每个线程一份缓冲区
+    static thread_local char string[2048];
+
+    const std::string str = Read<std::string>();
+    str.copy(string, sizeof(string) - 1);
+    string[str.size()] = 0;
 
     return string;
 
@@ -157,9 +169,9 @@ inline int32_t BufferReader::ReadLong(void)
     return Read<int32_t>();
 }
 
-inline char *BufferReader::ReadString(void)
+inline std::string BufferReader::ReadString(void)
 {
-    return Read<char*>();
+    return Read<std::string>();
 }
 
 inline float BufferReader::ReadFloat(void)